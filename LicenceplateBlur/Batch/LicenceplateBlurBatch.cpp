@@ -0,0 +1,566 @@
+/*
+ * Licence plate blur on image sequences, outside of any OFX host.
+ *
+ * The frames flow through a bounded pipeline:
+ *   reader -> workers -> writer
+ * Each worker detects the plates of a frame and blurs them, so that every
+ * worker is busy whether detection is on or off. Frame buffers come from a
+ * fixed pool and keep the native depth of the files: the reader blocks when all
+ * of them are in flight, so memory use does not depend on the length of the
+ * sequence. The workers process different frames in parallel, and the writer
+ * puts the frames back in order.
+ *
+ * An interrupt (Ctrl-C) stops every stage at its next cancellation checkpoint;
+ * frames that were not completely processed are not written.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "BoxBlur.h"
+#include "Cancellation.h"
+#include "FeaturePlanes.h"
+#include "PlateDetector.h"
+#include "Netpbm.h"
+#include "Pipeline.h"
+
+// default number of frame buffers: enough to keep the workers of a workstation busy,
+// without holding dozens of large frames on a many-core machine
+#define kDefaultMaxBuffers 16
+
+namespace {
+
+	typedef std::chrono::steady_clock Clock;
+
+	std::atomic<bool> interrupted(false);
+	std::atomic<Clock::rep> interruptedAt(0); // when the signal arrived, for the latency report
+
+	void onInterrupt(int)
+	{
+		// lock-free stores and the monotonic clock are safe in a signal handler
+		interruptedAt.store(Clock::now().time_since_epoch().count());
+		interrupted.store(true);
+	}
+
+	struct Options
+	{
+		std::string input;  // printf-style patterns, e.g. frame.%04d.ppm
+		std::string output;
+		std::string plates; // sidecar file listing the plates of each frame, or empty
+		int first, last;
+		double size;
+		bool detect;
+		double edgeThreshold;
+		double edgeDensity;
+		int workers;
+		int buffers;
+
+		Options()
+			: first(0)
+			, last(-1)
+			, size(10.)
+			, detect(true)
+			, edgeThreshold(0.15)
+			, edgeDensity(0.2)
+			, workers(0)
+			, buffers(0)
+		{
+		}
+	};
+
+	struct Frame
+	{
+		int index;
+		NetpbmImage image;
+		std::vector<PlateRect> plates;
+	};
+
+	/* per-worker scratch buffers, reused from frame to frame */
+	struct WorkerScratch
+	{
+		FeaturePlanes planes;
+		std::vector<float> line;
+		std::vector<std::vector<float> > results;
+	};
+
+	/* a filtered value as a sample of the image, rounded and clamped for the integer formats */
+	template <class PIX>
+	PIX toSample(float v, int maxValue)
+	{
+		if (!std::numeric_limits<PIX>::is_integer) {
+			return (PIX)v;
+		}
+
+		return (PIX)((v <= 0.f) ? 0 : (v >= maxValue) ? maxValue : (int)(v + 0.5f));
+	}
+
+	/* box blur of one rectangle of the image. The image is extended by its edge pixels.
+	   Each strip of a filtered row is given to emit(x1, x2, y, values). */
+	template <class PIX, int nComponents, class EmitFn>
+	bool blurRect(const NetpbmImage& image, const PlateRect& rect, int radius, WorkerScratch* scratch, EmitFn emit, Cancellation* cancel)
+	{
+		scratch->line.resize(((std::min)(rect.x2 - rect.x1, BoxBlur::stripWidth<nComponents>()) + 2 * radius) * nComponents);
+
+		return BoxBlur::blurStrips<nComponents>(rect.x1, rect.x2, rect.y1, rect.y2, radius, 0, image.height,
+			[&](int x1, int x2, int y, float* filtered) {
+				const int width = x2 - x1;
+				const PIX* src = image.row<PIX>(y);
+				for (int i = 0; i < width + 2 * radius; ++i) {
+					const int x = (std::max)(0, (std::min)(x1 - radius + i, image.width - 1));
+					for (int c = 0; c < nComponents; ++c) {
+						scratch->line[i * nComponents + c] = (float)src[x * nComponents + c];
+					}
+				}
+				BoxBlur::blurRow<nComponents>(&scratch->line[0], width, radius, filtered);
+			},
+			emit,
+			cancel);
+	}
+
+	/* blur all the plates of a frame, in place */
+	template <class PIX, int nComponents>
+	bool blurPlates(Frame* frame, int radius, WorkerScratch* scratch, Cancellation* cancel)
+	{
+		NetpbmImage& image = frame->image;
+		const int maxValue = image.maxValue;
+		if ((frame->plates.size() == 1) && (frame->plates[0].x2 - frame->plates[0].x1 <= BoxBlur::stripWidth<nComponents>())) {
+			// a row is emitted after the last time it is read, so it can be written back at once.
+			// With several strips, a strip would read the pixels already blurred by its left neighbour.
+			const PlateRect& rect = frame->plates[0];
+			return blurRect<PIX, nComponents>(image, rect, radius, scratch,
+				[&](int x1, int x2, int y, const float* values) {
+					PIX* dst = image.row<PIX>(y) + x1 * nComponents;
+					for (int i = 0; i < (x2 - x1) * nComponents; ++i) {
+						dst[i] = toSample<PIX>(values[i], maxValue);
+					}
+				},
+				cancel);
+		}
+
+		// a plate, or a strip of a wide plate, would read the pixels already blurred by its neighbour:
+		// results are written back once every plate has been filtered
+		scratch->results.resize((std::max)(scratch->results.size(), frame->plates.size()));
+		for (size_t i = 0; i < frame->plates.size(); ++i) {
+			const PlateRect& rect = frame->plates[i];
+			const size_t rowSize = (size_t)(rect.x2 - rect.x1) * nComponents;
+			std::vector<float>& result = scratch->results[i];
+			result.resize((rect.y2 - rect.y1) * rowSize);
+			const bool done = blurRect<PIX, nComponents>(image, rect, radius, scratch,
+				[&](int x1, int x2, int y, const float* values) {
+					std::copy(values, values + (x2 - x1) * nComponents, &result[(y - rect.y1) * rowSize + (x1 - rect.x1) * nComponents]);
+				},
+				cancel);
+			if (!done) {
+				return false;
+			}
+		}
+		for (size_t i = 0; i < frame->plates.size(); ++i) {
+			const PlateRect& rect = frame->plates[i];
+			const size_t rowSize = (size_t)(rect.x2 - rect.x1) * nComponents;
+			for (int y = rect.y1; y < rect.y2; ++y) {
+				if (cancel->aborted()) {
+					return false;
+				}
+				const float* src = &scratch->results[i][(y - rect.y1) * rowSize];
+				PIX* dst = image.row<PIX>(y) + rect.x1 * nComponents;
+				for (size_t j = 0; j < rowSize; ++j) {
+					dst[j] = toSample<PIX>(src[j], maxValue);
+				}
+			}
+		}
+
+		return true;
+	}
+
+	class BatchJob
+	{
+	public:
+		explicit BatchJob(const Options& options)
+			: _options(options)
+			, _free(options.buffers)
+			, _toProcess(options.buffers)
+			, _toWrite(options.buffers)
+			, _processing(options.workers)
+			, _written(0)
+			, _running(0)
+			, _cancel([] { return interrupted.load(); })
+		{
+			for (int i = 0; i < options.buffers; ++i) {
+				_frames.push_back(std::unique_ptr<Frame>(new Frame()));
+				_free.push(_frames.back().get());
+			}
+		}
+
+		/** @brief returns the number of frames written, throws on error */
+		int run()
+		{
+			std::vector<std::thread> threads;
+			_running.store(_options.workers + 2);
+			threads.push_back(std::thread(&BatchJob::stage, this, &BatchJob::read));
+			for (int i = 0; i < _options.workers; ++i) {
+				threads.push_back(std::thread(&BatchJob::stage, this, &BatchJob::work));
+			}
+			threads.push_back(std::thread(&BatchJob::stage, this, &BatchJob::write));
+			// a stage waiting on a queue never reaches a checkpoint: wake everybody up as soon as the interrupt arrives
+			while (_running.load() > 0) {
+				if (interrupted.load()) {
+					stop();
+					break;
+				}
+				std::this_thread::sleep_for(std::chrono::microseconds(kCancellationInterval));
+			}
+			for (size_t i = 0; i < threads.size(); ++i) {
+				threads[i].join();
+			}
+			if (!_error.empty()) {
+				throw std::runtime_error(_error);
+			}
+
+			return _written;
+		}
+
+		/** @brief remove the frame that was being written when the job was cancelled */
+		void removePartialOutput()
+		{
+			if (!_partial.empty()) {
+				std::remove(_partial.c_str());
+				_partial.clear();
+			}
+		}
+
+	private:
+		std::string path(const std::string& pattern, int index) const
+		{
+			char buf[4096];
+			std::snprintf(buf, sizeof(buf), pattern.c_str(), index);
+
+			return buf;
+		}
+
+		/* stop the whole pipeline, keeping the first error */
+		void fail(const std::string& message)
+		{
+			{
+				std::lock_guard<std::mutex> lock(_errorMutex);
+				if (_error.empty()) {
+					_error = message;
+				}
+			}
+			stop();
+		}
+
+		void stop()
+		{
+			_free.close();
+			_toProcess.close();
+			_toWrite.close();
+		}
+
+		void stage(void (BatchJob::*run)())
+		{
+			(this->*run)();
+			--_running;
+		}
+
+		void read()
+		{
+			try {
+				for (int i = _options.first; i <= _options.last; ++i) {
+					Frame* frame;
+					if (_cancel.aborted() || !_free.pop(&frame)) {
+						break;
+					}
+					frame->index = i;
+					frame->plates.clear();
+					if (!readNetpbm(path(_options.input, i), &frame->image, &_cancel) || !_toProcess.push(frame)) {
+						break;
+					}
+				}
+			}
+			catch (const std::exception& e) {
+				fail(e.what());
+			}
+			_toProcess.close();
+		}
+
+		void work()
+		{
+			WorkerScratch scratch;
+			Frame* frame;
+			try {
+				while (_toProcess.pop(&frame)) {
+					bool done;
+					const NetpbmImage& image = frame->image;
+					switch (image.sampleSize()) {
+					case 1:
+						done = (image.nComponents == 3) ? process<unsigned char, 3, 255>(frame, &scratch) : process<unsigned char, 1, 255>(frame, &scratch);
+						break;
+					case 2:
+						done = (image.nComponents == 3) ? process<unsigned short, 3, 65535>(frame, &scratch) : process<unsigned short, 1, 65535>(frame, &scratch);
+						break;
+					default:
+						done = (image.nComponents == 3) ? process<float, 3, 1>(frame, &scratch) : process<float, 1, 1>(frame, &scratch);
+						break;
+					}
+					if (!done) {
+						stop();
+						break;
+					}
+					if (!_toWrite.push(frame)) {
+						break;
+					}
+				}
+			}
+			catch (const std::exception& e) {
+				// e.g. out of memory on large frames
+				fail(e.what());
+			}
+			if (_processing.done()) {
+				_toWrite.close();
+			}
+		}
+
+		/* detect and blur the plates of one frame. maxValue is the range of the PIX type,
+		   the range of the file (image.maxValue) may be smaller. Returns false if cancelled. */
+		template <class PIX, int nComponents, int maxValue>
+		bool process(Frame* frame, WorkerScratch* scratch)
+		{
+			const NetpbmImage& image = frame->image;
+			if (!_options.detect) {
+				const PlateRect all = { 0, 0, image.width, image.height };
+				frame->plates.assign(1, all);
+			}
+			else {
+				if (!computeFeaturePlanes<PIX, nComponents, maxValue>(image.row<PIX>(0), (int)image.rowBytes(), 0, 0, image.width, image.height, &scratch->planes, &_cancel)) {
+					return false;
+				}
+				// the planes are relative to the range of PIX: so is the threshold
+				const double range = (image.maxValue > 0) ? (double)image.maxValue / maxValue : 1.;
+				PlateDetectorParams params;
+				params.edgeThreshold = (int)(_options.edgeThreshold * 255. * range + 0.5);
+				params.edgeDensity = _options.edgeDensity;
+				PlateDetector detector(params);
+				if (!detector.detect(scratch->planes, &frame->plates, &_cancel)) {
+					return false;
+				}
+			}
+
+			return blurPlates<PIX, nComponents>(frame, BoxBlur::radiusPixels(_options.size, 1.), scratch, &_cancel);
+		}
+
+		/* frames arrive in any order: hold them until the previous ones are written */
+		void write()
+		{
+			std::map<int, Frame*> pending;
+			int next = _options.first;
+			Frame* frame;
+			FILE* sidecar = NULL;
+			try {
+				if (!_options.plates.empty()) {
+					sidecar = std::fopen(_options.plates.c_str(), "w");
+					if (!sidecar) {
+						throw std::runtime_error("cannot open " + _options.plates);
+					}
+				}
+				while (_toWrite.pop(&frame)) {
+					if (_cancel.aborted()) {
+						stop();
+						break;
+					}
+					pending[frame->index] = frame;
+					while (!pending.empty() && pending.begin()->first == next) {
+						frame = pending.begin()->second;
+						pending.erase(pending.begin());
+						const std::string output = path(_options.output, frame->index);
+						if (!writeNetpbm(output, frame->image, &_cancel)) {
+							_partial = output;
+							break;
+						}
+						writePlates(sidecar, *frame);
+						++_written;
+						++next;
+						_free.push(frame);
+					}
+				}
+			}
+			catch (const std::exception& e) {
+				fail(e.what());
+			}
+			if (sidecar && std::fclose(sidecar) != 0) {
+				fail("cannot write " + _options.plates);
+			}
+			_free.close();
+		}
+
+		/* one line per frame: the frame number, the number of plates, then x1 y1 x2 y2 for each plate
+		   (pixel coordinates, origin at the top-left corner, x2 and y2 excluded) */
+		void writePlates(FILE* sidecar, const Frame& frame)
+		{
+			if (!sidecar) {
+				return;
+			}
+			bool ok = std::fprintf(sidecar, "%d %d", frame.index, (int)frame.plates.size()) > 0;
+			for (size_t i = 0; ok && i < frame.plates.size(); ++i) {
+				const PlateRect& r = frame.plates[i];
+				ok = std::fprintf(sidecar, " %d %d %d %d", r.x1, r.y1, r.x2, r.y2) > 0;
+			}
+			if (!ok || std::fprintf(sidecar, "\n") < 0) {
+				throw std::runtime_error("cannot write " + _options.plates);
+			}
+		}
+
+		const Options _options;
+		std::vector<std::unique_ptr<Frame> > _frames;
+		BoundedQueue<Frame*> _free;
+		BoundedQueue<Frame*> _toProcess;
+		BoundedQueue<Frame*> _toWrite;
+		StageCounter _processing;
+		int _written;
+		std::atomic<int> _running; // threads that have not returned yet
+		std::string _partial;      // output file left incomplete by a cancellation
+		std::mutex _errorMutex;
+		std::string _error;
+		Cancellation _cancel;
+	};
+
+	/* a pattern must contain exactly one integer conversion, e.g. %d or %04d */
+	bool validPattern(const std::string& pattern)
+	{
+		int conversions = 0;
+		for (size_t i = 0; i < pattern.size(); ++i) {
+			if (pattern[i] != '%') {
+				continue;
+			}
+			if (i + 1 < pattern.size() && pattern[i + 1] == '%') {
+				++i;
+				continue;
+			}
+			size_t j = i + 1;
+			while (j < pattern.size() && (pattern[j] == '0' || (pattern[j] >= '1' && pattern[j] <= '9'))) {
+				++j;
+			}
+			if (j == pattern.size() || pattern[j] != 'd') {
+				return false;
+			}
+			++conversions;
+			i = j;
+		}
+
+		return conversions == 1;
+	}
+
+	void usage(const char* program)
+	{
+		std::fprintf(stderr,
+			"usage: %s [options] <input pattern> <output pattern> <first frame> <last frame>\n"
+			"Blurs the licence plates of an image sequence (PGM/PPM, 8 or 16 bits, or PFM).\n"
+			"Patterns are printf-style, e.g. in/shot.%%04d.ppm\n"
+			"options:\n"
+			"  --size <pixels>           blur radius (default 10)\n"
+			"  --no-detect               blur the whole frames\n"
+			"  --plates <file>           also write the rectangles of the plates, one line per frame:\n"
+			"                            <frame> <count> then <x1> <y1> <x2> <y2> for each plate\n"
+			"  --edge-threshold <0-1>    minimum luminance difference of a character edge (default 0.15)\n"
+			"  --edge-density <0-1>      minimum fraction of edge pixels in a plate cell (default 0.2)\n"
+			"  --workers <n>             frames processed in parallel (default: the number of CPUs)\n"
+			"  --buffers <n>             frames in memory (default: workers + 2, at most %d)\n",
+			program, kDefaultMaxBuffers);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	Options options;
+	std::vector<std::string> positional;
+	for (int i = 1; i < argc; ++i) {
+		const std::string arg = argv[i];
+		const bool hasValue = (i + 1 < argc);
+		if (arg == "--no-detect") {
+			options.detect = false;
+		}
+		else if (arg == "--size" && hasValue) {
+			options.size = std::atof(argv[++i]);
+		}
+		else if (arg == "--plates" && hasValue) {
+			options.plates = argv[++i];
+		}
+		else if (arg == "--edge-threshold" && hasValue) {
+			options.edgeThreshold = std::atof(argv[++i]);
+		}
+		else if (arg == "--edge-density" && hasValue) {
+			options.edgeDensity = std::atof(argv[++i]);
+		}
+		else if (arg == "--workers" && hasValue) {
+			options.workers = std::atoi(argv[++i]);
+		}
+		else if (arg == "--buffers" && hasValue) {
+			options.buffers = std::atoi(argv[++i]);
+		}
+		else if (arg.size() > 1 && arg[0] == '-' && (arg[1] < '0' || arg[1] > '9')) {
+			usage(argv[0]);
+
+			return 1;
+		}
+		else {
+			positional.push_back(arg);
+		}
+	}
+	if (positional.size() != 4 || !validPattern(positional[0]) || !validPattern(positional[1])) {
+		usage(argv[0]);
+
+		return 1;
+	}
+	options.input = positional[0];
+	options.output = positional[1];
+	options.first = std::atoi(positional[2].c_str());
+	options.last = std::atoi(positional[3].c_str());
+
+	if (options.workers <= 0) {
+		options.workers = (std::max)(1, (int)std::thread::hardware_concurrency());
+	}
+	if (options.buffers <= 0) {
+		// one frame being read and one being written, the others being processed
+		options.buffers = (std::min)(options.workers + 2, kDefaultMaxBuffers);
+	}
+	// a worker without a frame buffer would have nothing to do
+	options.workers = (std::min)(options.workers, options.buffers);
+
+	std::signal(SIGINT, onInterrupt);
+	const Clock::time_point start = Clock::now();
+	try {
+		BatchJob job(options);
+		const int frames = job.run();
+		if (interrupted.load()) {
+			// every stage has returned: the time to remove the incomplete output is not part of the latency
+			const Clock::time_point stopped = Clock::now();
+			job.removePartialOutput();
+			std::fprintf(stderr, "interrupted after %d frames, stopped %.2f ms after the interrupt (cleaned up in %.2f ms)\n", frames,
+				(stopped.time_since_epoch().count() - interruptedAt.load()) * 1000. * Clock::period::num / Clock::period::den,
+				std::chrono::duration<double, std::milli>(Clock::now() - stopped).count());
+
+			return 130;
+		}
+		const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+		std::fprintf(stderr, "%d frames in %.2f s (%.2f fps)\n", frames, seconds, (seconds > 0.) ? frames / seconds : 0.);
+	}
+	catch (const std::exception& e) {
+		std::fprintf(stderr, "error: %s\n", e.what());
+
+		return 1;
+	}
+
+	return 0;
+}
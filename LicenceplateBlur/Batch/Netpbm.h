@@ -0,0 +1,206 @@
+#ifndef NETPBM_H
+#define NETPBM_H
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Cancellation.h"
+
+/*
+ * Minimal reader and writer for binary PGM/PPM (P5, P6, 8 or 16 bits) and
+ * PFM (Pf, PF) images. Pixels are kept at their native depth, interleaved, top
+ * row first: unsigned char or unsigned short samples from 0 to maxValue (in
+ * host byte order), or floats for PFM.
+ */
+
+struct NetpbmImage
+{
+	int width, height;
+	int nComponents; // 1 (grey) or 3 (RGB)
+	int maxValue;    // 1 to 65535 for PGM/PPM, 0 for PFM
+	std::vector<unsigned char> data;
+
+	NetpbmImage() : width(0), height(0), nComponents(0), maxValue(0) {}
+
+	/** @brief 1 or 2 bytes for PGM/PPM, depending on maxValue, 4 for PFM */
+	size_t sampleSize() const { return (maxValue == 0) ? sizeof(float) : (maxValue > 255) ? 2 : 1; }
+	size_t rowBytes() const { return (size_t)width * nComponents * sampleSize(); }
+
+	template <class PIX>
+	PIX* row(int y) { return (PIX*)&data[y * rowBytes()]; }
+
+	template <class PIX>
+	const PIX* row(int y) const { return (const PIX*)&data[y * rowBytes()]; }
+};
+
+namespace NetpbmInternal {
+
+	class File
+	{
+	public:
+		File(const std::string& path, const char* mode)
+			: _f(std::fopen(path.c_str(), mode))
+		{
+			if (!_f) {
+				throw std::runtime_error("cannot open " + path);
+			}
+		}
+
+		~File()
+		{
+			std::fclose(_f);
+		}
+
+		FILE* get() const { return _f; }
+
+	private:
+		File(const File&);
+		File& operator=(const File&);
+
+		FILE* _f;
+	};
+
+	/* the next header token, skipping white space and comments */
+	inline std::string token(FILE* f)
+	{
+		std::string s;
+		int c = std::fgetc(f);
+		while (c != EOF && (std::isspace(c) || c == '#')) {
+			if (c == '#') {
+				while (c != EOF && c != '\n') {
+					c = std::fgetc(f);
+				}
+			}
+			c = std::fgetc(f);
+		}
+		while (c != EOF && !std::isspace(c)) {
+			s += (char)c;
+			c = std::fgetc(f);
+		}
+		// the single white space character that ends the header is consumed here
+
+		return s;
+	}
+
+	inline bool littleEndianHost()
+	{
+		const uint16_t one = 1;
+
+		return *(const unsigned char*)&one == 1;
+	}
+
+	inline void swapBytes(void* data, size_t size, size_t count)
+	{
+		unsigned char* p = (unsigned char*)data;
+		for (size_t i = 0; i < count; ++i, p += size) {
+			for (size_t j = 0; j < size / 2; ++j) {
+				const unsigned char t = p[j];
+				p[j] = p[size - 1 - j];
+				p[size - 1 - j] = t;
+			}
+		}
+	}
+}
+
+/** @brief read an image, reusing the storage of image->data. Returns false if cancelled. */
+inline bool readNetpbm(const std::string& path, NetpbmImage* image, Cancellation* cancel = NULL)
+{
+	using namespace NetpbmInternal;
+	File file(path, "rb");
+	FILE* f = file.get();
+	const std::string magic = token(f);
+	const bool pfm = (magic == "PF" || magic == "Pf");
+	if (!pfm && magic != "P5" && magic != "P6") {
+		throw std::runtime_error(path + ": unsupported format " + magic);
+	}
+	image->nComponents = (magic == "PF" || magic == "P6") ? 3 : 1;
+	image->width = std::atoi(token(f).c_str());
+	image->height = std::atoi(token(f).c_str());
+	const double scale = std::atof(token(f).c_str());
+	if (image->width <= 0 || image->height <= 0 || (!pfm && (scale < 1 || scale > 65535))) {
+		throw std::runtime_error(path + ": bad header");
+	}
+	image->maxValue = pfm ? 0 : (int)scale;
+	const size_t rowBytes = image->rowBytes();
+	const size_t sampleSize = image->sampleSize();
+	const size_t rowSize = rowBytes / sampleSize;
+	image->data.resize(rowBytes * image->height);
+	// PFM is little-endian if the scale is negative, 16-bit samples are big-endian
+	const bool swap = pfm ? ((scale < 0) != littleEndianHost()) : (sampleSize == 2 && littleEndianHost());
+
+	// PFM rows are stored bottom to top
+	for (int i = 0; i < image->height; ++i) {
+		if (cancel && cancel->aborted()) {
+			return false;
+		}
+		unsigned char* row = &image->data[(pfm ? image->height - 1 - i : i) * rowBytes];
+		if (std::fread(row, sampleSize, rowSize, f) != rowSize) {
+			throw std::runtime_error(path + ": truncated file");
+		}
+		if (swap) {
+			swapBytes(row, sampleSize, rowSize);
+		}
+	}
+
+	return true;
+}
+
+/** @brief write an image in the format it was read from.
+ *
+ * Returns false if cancelled, in which case the partially written file is closed
+ * and left for the caller to remove: unlinking a large file that was just
+ * written can take longer than the whole cancellation.
+ */
+inline bool writeNetpbm(const std::string& path, const NetpbmImage& image, Cancellation* cancel = NULL)
+{
+	using namespace NetpbmInternal;
+	File file(path, "wb");
+	FILE* f = file.get();
+	const bool pfm = (image.maxValue == 0);
+	const size_t rowBytes = image.rowBytes();
+	const size_t sampleSize = image.sampleSize();
+	const size_t rowSize = rowBytes / sampleSize;
+	// PFM is written in host byte order, 16-bit samples must be big-endian
+	const bool swap = !pfm && (sampleSize == 2) && littleEndianHost();
+	std::vector<unsigned char> swapped(swap ? rowBytes : 0);
+	bool ok;
+	bool cancelled = false;
+
+	if (pfm) {
+		ok = std::fprintf(f, "%s\n%d %d\n%s\n", (image.nComponents == 3) ? "PF" : "Pf", image.width, image.height,
+			littleEndianHost() ? "-1.0" : "1.0") > 0;
+	}
+	else {
+		ok = std::fprintf(f, "%s\n%d %d\n%d\n", (image.nComponents == 3) ? "P6" : "P5", image.width, image.height, image.maxValue) > 0;
+	}
+	for (int i = 0; ok && i < image.height; ++i) {
+		cancelled = cancel && cancel->aborted();
+		if (cancelled) {
+			break;
+		}
+		const unsigned char* row = &image.data[(pfm ? image.height - 1 - i : i) * rowBytes];
+		if (swap) {
+			std::copy(row, row + rowBytes, swapped.begin());
+			swapBytes(&swapped[0], sampleSize, rowSize);
+			row = &swapped[0];
+		}
+		ok = std::fwrite(row, sampleSize, rowSize, f) == rowSize;
+	}
+	if (cancelled) {
+		return false;
+	}
+	if (!ok || std::fflush(f) != 0) {
+		throw std::runtime_error("cannot write " + path);
+	}
+
+	return true;
+}
+
+#endif // !NETPBM_H
@@ -0,0 +1,95 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+/*
+ * Building blocks of the batch pipeline.
+ */
+
+/** @brief a blocking FIFO with a fixed capacity.
+ *
+ * push() blocks while the queue is full, which propagates backpressure to the
+ * stage upstream. Once close() is called, push() drops its item and returns
+ * false, and pop() returns false when the queue is empty.
+ */
+template <class T>
+class BoundedQueue
+{
+public:
+	explicit BoundedQueue(size_t capacity)
+		: _capacity(capacity ? capacity : 1)
+		, _closed(false)
+	{
+	}
+
+	bool push(const T& item)
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		_notFull.wait(lock, [this] { return _closed || _items.size() < _capacity; });
+		if (_closed) {
+			return false;
+		}
+		_items.push_back(item);
+		_notEmpty.notify_one();
+
+		return true;
+	}
+
+	bool pop(T* item)
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		_notEmpty.wait(lock, [this] { return _closed || !_items.empty(); });
+		if (_items.empty()) {
+			return false;
+		}
+		*item = _items.front();
+		_items.pop_front();
+		_notFull.notify_one();
+
+		return true;
+	}
+
+	/** @brief no more items will be pushed: wake up everybody */
+	void close()
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_closed = true;
+		_notFull.notify_all();
+		_notEmpty.notify_all();
+	}
+
+private:
+	const size_t _capacity;
+	bool _closed;
+	std::deque<T> _items;
+	std::mutex _mutex;
+	std::condition_variable _notFull;
+	std::condition_variable _notEmpty;
+};
+
+/** @brief counts the workers of a stage, so that the last one to finish closes the next queue */
+class StageCounter
+{
+public:
+	explicit StageCounter(int workers)
+		: _running(workers)
+	{
+	}
+
+	/** @brief returns true for the last worker */
+	bool done()
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		return --_running == 0;
+	}
+
+private:
+	int _running;
+	std::mutex _mutex;
+};
+
+#endif // !PIPELINE_H
@@ -0,0 +1,171 @@
+#ifndef BOXBLUR_H
+#define BOXBLUR_H
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+#include "Cancellation.h"
+
+/*
+ * Separable running-sum box filter on interleaved float pixels.
+ *
+ * These helpers do not depend on the OFX support library, so that they can be
+ * shared by the plugin processor and by command-line tools.
+ */
+
+// width in bytes of a strip of filtered columns: the rows kept by the vertical pass stay in cache
+#define kBoxBlurStripBytes 8192
+
+namespace BoxBlur {
+
+	/** @brief blur radius in pixels at the given render scale, for a size given in pixels at scale 1 */
+	inline int radiusPixels(double size, double renderScale)
+	{
+		return (size > 0.) ? (int)std::floor(size * renderScale + 0.5) : 0;
+	}
+
+	/** @brief horizontal pass over one row.
+	 *
+	 * line holds (width + 2 * radius) pixels, i.e. the row already extended by
+	 * radius pixels on each side. out receives width filtered pixels.
+	 */
+	template <int nComponents>
+	void blurRow(const float* line, int width, int radius, float* out)
+	{
+		const float scale = 1.f / (2 * radius + 1);
+		float sum[nComponents];
+		for (int c = 0; c < nComponents; ++c) {
+			sum[c] = 0.f;
+		}
+		for (int i = 0; i < 2 * radius + 1; ++i) {
+			for (int c = 0; c < nComponents; ++c) {
+				sum[c] += line[i * nComponents + c];
+			}
+		}
+		for (int x = 0; x < width; ++x) {
+			for (int c = 0; c < nComponents; ++c) {
+				out[x * nComponents + c] = sum[c] * scale;
+			}
+			if (x + 1 < width) {
+				const float* add = line + (x + 2 * radius + 1) * nComponents;
+				const float* sub = line + x * nComponents;
+				for (int c = 0; c < nComponents; ++c) {
+					sum[c] += add[c] - sub[c];
+				}
+			}
+		}
+	}
+
+	/** @brief vertical pass, fed one horizontally filtered row at a time.
+	 *
+	 * Walking one column at a time down rows that are a full stride apart misses
+	 * the cache on every step. Instead, a running-sum vector holds one entry per
+	 * column, and each output row only touches two contiguous rows (the row
+	 * entering and the row leaving the window).
+	 *
+	 * filterRow(y, out) must write the horizontally filtered source row y (width
+	 * pixels) to out. It is called once for each source row in [yFirst, yLast)
+	 * that the blur reads, in increasing order; rows outside of that range are
+	 * replaced by the nearest edge row. Only the 2 * radius + 2 rows that the
+	 * running sums still need are kept, so the memory used does not depend on
+	 * the height of the window. emit(y, values) receives the width filtered
+	 * pixels of row y, for y in [y1, y2).
+	 *
+	 * Returns false if cancelled, in which case only part of the rows were emitted.
+	 */
+	template <int nComponents, class FilterFn, class EmitFn>
+	bool blurColumns(int width, int y1, int y2, int radius, int yFirst, int yLast, FilterFn filterRow, EmitFn emit, Cancellation* cancel = NULL)
+	{
+		assert(yFirst < yLast);
+		const size_t rowSize = (size_t)width * nComponents;
+		const int ringRows = (std::min)(2 * radius + 2, yLast - yFirst);
+		const float scale = 1.f / (2 * radius + 1);
+		std::vector<float> ring(ringRows * rowSize);
+		std::vector<float> sums(rowSize, 0.f);
+		std::vector<float> values(rowSize);
+		// next source row to filter: the rows above the first one read are never filtered
+		int next = (std::max)(yFirst, (std::min)(y1 - radius, yLast - 1));
+		// filtered row y, or NULL if cancelled: the rows still needed are at most ringRows apart, so their slots never collide
+		auto row = [&](int y) -> const float* {
+			const int ys = (std::max)(yFirst, (std::min)(y, yLast - 1));
+			for (; next <= ys; ++next) {
+				if (cancel && cancel->aborted()) {
+					return NULL;
+				}
+				filterRow(next, &ring[((next - yFirst) % ringRows) * rowSize]);
+			}
+
+			return &ring[((ys - yFirst) % ringRows) * rowSize];
+		};
+
+		for (int y = y1 - radius; y <= y1 + radius; ++y) {
+			const float* r = row(y);
+			if (!r) {
+				return false;
+			}
+			for (size_t i = 0; i < rowSize; ++i) {
+				sums[i] += r[i];
+			}
+		}
+		for (int y = y1; y < y2; ++y) {
+			if (cancel && cancel->aborted()) {
+				return false;
+			}
+			for (size_t i = 0; i < rowSize; ++i) {
+				values[i] = sums[i] * scale;
+			}
+			emit(y, &values[0]);
+			if (y + 1 < y2) {
+				const float* add = row(y + radius + 1);
+				const float* sub = row(y - radius);
+				if (!add || !sub) {
+					return false;
+				}
+				for (size_t i = 0; i < rowSize; ++i) {
+					sums[i] += add[i] - sub[i];
+				}
+			}
+		}
+
+		return true;
+	}
+
+	/** @brief number of columns in a strip of kBoxBlurStripBytes */
+	template <int nComponents>
+	int stripWidth()
+	{
+		return (std::max)(1, (int)(kBoxBlurStripBytes / (sizeof(float) * nComponents)));
+	}
+
+	/** @brief blurColumns() on the columns [x1, x2), one strip of stripWidth() columns at a time.
+	 *
+	 * On wide windows, the 2 * radius + 2 full rows kept by blurColumns() fall out
+	 * of the cache. A strip only costs radius extra pixels on each side to the
+	 * horizontal pass. filterRow(sx1, sx2, y, out) and emit(sx1, sx2, y, values)
+	 * work on the columns [sx1, sx2) of the current strip.
+	 *
+	 * Returns false if cancelled.
+	 */
+	template <int nComponents, class FilterFn, class EmitFn>
+	bool blurStrips(int x1, int x2, int y1, int y2, int radius, int yFirst, int yLast, FilterFn filterRow, EmitFn emit, Cancellation* cancel = NULL)
+	{
+		const int strip = stripWidth<nComponents>();
+		for (int sx1 = x1; sx1 < x2; sx1 += strip) {
+			const int sx2 = (std::min)(x2, sx1 + strip);
+			const bool done = blurColumns<nComponents>(sx2 - sx1, y1, y2, radius, yFirst, yLast,
+				[&](int y, float* out) { filterRow(sx1, sx2, y, out); },
+				[&](int y, const float* values) { emit(sx1, sx2, y, values); },
+				cancel);
+			if (!done) {
+				return false;
+			}
+		}
+
+		return true;
+	}
+}
+
+#endif // !BOXBLUR_H
@@ -0,0 +1,90 @@
+#ifndef CANCELLATION_H
+#define CANCELLATION_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+/*
+ * Cooperative cancellation for the long-running stages.
+ *
+ * The stages call aborted() at every checkpoint (typically once per row). The
+ * abort callback, which may be an expensive host call, is only polled once per
+ * kCancellationInterval microseconds, so that checkpoints can be placed densely.
+ * Once an abort has been seen, aborted() keeps returning true.
+ *
+ * One object is shared by all the threads working on the same render.
+ */
+
+// time between two calls to the abort callback, in microseconds
+#define kCancellationInterval 1000
+
+class Cancellation
+{
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	explicit Cancellation(const std::function<bool()>& abort)
+		: _abort(abort)
+		, _aborted(false)
+		, _nextPoll(0)
+		, _lastClear(microseconds())
+		, _abortedAfter(0)
+	{
+	}
+
+	bool aborted()
+	{
+		if (_aborted.load(std::memory_order_relaxed)) {
+			return true;
+		}
+		const int64_t now = microseconds();
+		if (now < _nextPoll.load(std::memory_order_relaxed)) {
+			return false;
+		}
+		_nextPoll.store(now + kCancellationInterval, std::memory_order_relaxed);
+		const int64_t clear = _lastClear.load(std::memory_order_relaxed);
+		if (!_abort()) {
+			_lastClear.store(now, std::memory_order_relaxed);
+
+			return false;
+		}
+		int64_t none = 0;
+		_abortedAfter.compare_exchange_strong(none, clear);
+		_aborted.store(true);
+
+		return true;
+	}
+
+	/** @brief true if a checkpoint has seen the abort */
+	bool wasAborted() const
+	{
+		return _aborted.load();
+	}
+
+	/** @brief upper bound of the time elapsed since the abort, in milliseconds.
+	 *
+	 * The abort happened after the last poll that did not see it, so this
+	 * includes the polling interval and the time between checkpoints.
+	 */
+	double millisecondsSinceAbort() const
+	{
+		return wasAborted() ? (microseconds() - _abortedAfter.load()) / 1000. : 0.;
+	}
+
+private:
+	static int64_t microseconds()
+	{
+		// never 0, which marks an unset time
+		return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now().time_since_epoch()).count() + 1;
+	}
+
+	std::function<bool()> _abort;
+	std::atomic<bool> _aborted;
+	std::atomic<int64_t> _nextPoll;
+	std::atomic<int64_t> _lastClear;    // time of the last poll that did not see an abort
+	std::atomic<int64_t> _abortedAfter; // _lastClear when the abort was first seen
+};
+
+#endif // !CANCELLATION_H
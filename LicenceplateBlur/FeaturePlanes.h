@@ -0,0 +1,104 @@
+#ifndef FEATUREPLANES_H
+#define FEATUREPLANES_H
+
+#include <cstddef>
+#include <vector>
+
+#include "Cancellation.h"
+
+/*
+ * Compact per-frame planes read by the plate detection stages.
+ *
+ * The interleaved source pixels are read and converted exactly once per frame;
+ * every detection stage then works on these 8-bit planes, which are a fraction
+ * of the size of the source image (1/16 of a 4-channel float image).
+ */
+
+struct FeaturePlanes
+{
+	int x1, y1;        // pixel coordinates of the first pixel of the planes
+	int width, height;
+	std::vector<unsigned char> luma;     // Rec. 709 luma
+	std::vector<unsigned char> gradient; // absolute horizontal luma gradient
+
+	FeaturePlanes() : x1(0), y1(0), width(0), height(0) {}
+
+	const unsigned char* lumaRow(int y) const { return &luma[(size_t)y * width]; }
+	const unsigned char* gradientRow(int y) const { return &gradient[(size_t)y * width]; }
+};
+
+namespace FeaturePlanesInternal {
+
+	inline unsigned char toByte(float v)
+	{
+		return (unsigned char)((v <= 0.f) ? 0.f : (v >= 255.f) ? 255.f : v + 0.5f);
+	}
+
+	/* luma of one row, in the [0,255] range. Branch-free so that it vectorizes for all pixel types. */
+	template <class PIX, int nComponents, int maxValue>
+	void lumaRow(const PIX* pix, int width, unsigned char* luma)
+	{
+		const float k = 255.f / maxValue;
+		for (int x = 0; x < width; ++x) {
+			const PIX* p = pix + x * nComponents;
+			float l;
+			if (nComponents >= 3) {
+				l = 0.2126f * p[0] + 0.7152f * p[1] + 0.0722f * p[2];
+			}
+			else {
+				// alpha or XY: the first component is the only intensity we have
+				l = (float)p[0];
+			}
+			luma[x] = toByte(l * k);
+		}
+	}
+
+	/* |l(x+1) - l(x-1)|, the edges of the row being extended */
+	inline void gradientRow(const unsigned char* luma, int width, unsigned char* gradient)
+	{
+		if (width < 2) {
+			for (int x = 0; x < width; ++x) {
+				gradient[x] = 0;
+			}
+
+			return;
+		}
+		gradient[0] = (unsigned char)((luma[1] > luma[0]) ? luma[1] - luma[0] : luma[0] - luma[1]);
+		for (int x = 1; x < width - 1; ++x) {
+			const int d = (int)luma[x + 1] - (int)luma[x - 1];
+			gradient[x] = (unsigned char)((d < 0) ? -d : d);
+		}
+		gradient[width - 1] = (unsigned char)((luma[width - 1] > luma[width - 2]) ? luma[width - 1] - luma[width - 2] : luma[width - 2] - luma[width - 1]);
+	}
+}
+
+/** @brief compute the luma and gradient planes in a single pass over the source.
+ *
+ * data points to pixel (x1, y1), rowBytes is the (possibly negative) distance in
+ * bytes between two rows. Each source row is read once, and its gradient is
+ * computed while its luma row is still in cache.
+ * Returns false if cancelled, leaving the planes incomplete.
+ */
+template <class PIX, int nComponents, int maxValue>
+bool computeFeaturePlanes(const void* data, int rowBytes, int x1, int y1, int x2, int y2, FeaturePlanes* planes, Cancellation* cancel = NULL)
+{
+	planes->x1 = x1;
+	planes->y1 = y1;
+	planes->width = (x2 > x1) ? (x2 - x1) : 0;
+	planes->height = (y2 > y1) ? (y2 - y1) : 0;
+	planes->luma.resize((size_t)planes->width * planes->height);
+	planes->gradient.resize((size_t)planes->width * planes->height);
+	for (int y = 0; y < planes->height; ++y) {
+		if (cancel && cancel->aborted()) {
+			return false;
+		}
+		const PIX* pix = (const PIX*)((const char*)data + (ptrdiff_t)y * rowBytes);
+		unsigned char* luma = &planes->luma[(size_t)y * planes->width];
+		FeaturePlanesInternal::lumaRow<PIX, nComponents, maxValue>(pix, planes->width, luma);
+		FeaturePlanesInternal::gradientRow(luma, planes->width, &planes->gradient[(size_t)y * planes->width]);
+	}
+
+	return true;
+}
+
+#endif // !FEATUREPLANES_H
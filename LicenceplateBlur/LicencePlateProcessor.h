@@ -1,7 +1,15 @@
 #ifndef LICENCEPLATEPROCESSOR_H
 #define LICENCEPLATEPROCESSOR_H
 
+#include <algorithm>
+#include <cfloat>
+#include <limits>
+#include <vector>
+
 #include "LicencePlateProcessorBase.h"
+#include "BoxBlur.h"
+#include "ofxsCoords.h"
+#include "ofxsMaskMix.h"
 #include "ofxsMacros.h"
 
 using namespace OFX;
@@ -106,63 +114,245 @@ private:
 	template<bool processR, bool processG, bool processB, bool processA>
 	void process(const OfxRectI& procWindow, const OfxPointD& rs)
 	{
-		unused(rs);
-		assert(nComponents == 1 || nComponents == 3 || nComponents == 4);
+		assert(nComponents >= 1 && nComponents <= 4);
 		assert(_dstImg);
-		float unpPix[4] = { 0.f, 0.f, 0.f, 0.f };
-		float tmpPix[4] = { 0.f, 0.f, 0.f, 0.f };
-		for (int y = procWindow.y1; y < procWindow.y2; y++) {
-			if (_effect.abort()) {
-				break;
+		processChannels<processR, processG, processB, processA>(procWindow, rs);
+		if (_plateMask && (nComponents == 4)) {
+			writePlateMask(procWindow);
+		}
+	}
+
+	template<bool processR, bool processG, bool processB, bool processA>
+	void processChannels(const OfxRectI& procWindow, const OfxPointD& rs)
+	{
+		OfxRectI srcWindow;
+		if (!_srcImg || !Coords::rectIntersection<OfxRectI>(procWindow, _srcImg->getBounds(), &srcWindow)) {
+			if (_plates) {
+				copySource(procWindow);
+
+				return;
 			}
+			processNoSource<processR, processG, processB, processA>(procWindow);
 
-			PIX* dstPix = (PIX*)_dstImg->getPixelAddress(procWindow.x1, y);
+			return;
+		}
+		if (_plates) {
+			// outside of the plates, the source is copied unchanged
+			copySource(procWindow);
+			for (std::vector<OfxRectI>::const_iterator it = _plates->begin(); it != _plates->end() && !aborted(); ++it) {
+				OfxRectI plateWindow;
+				if (Coords::rectIntersection<OfxRectI>(srcWindow, *it, &plateWindow)) {
+					blur<processR, processG, processB, processA>(plateWindow,
+						BoxBlur::radiusPixels(_size, rs.x),
+						BoxBlur::radiusPixels(_size, rs.y));
+				}
+			}
 
-			for (int x = procWindow.x1; x < procWindow.x2; x++) {
-				const PIX* srcPix = (const PIX*)(_srcImg ? _srcImg->getPixelAddress(x, y) : 0);
-				ofxsUnPremult<PIX, nComponents, maxValue>(srcPix, unpPix, _premult, _premultChannel);
-				for (int c = 0; c < 4; ++c) {
-					if (processR && (c == 0)) {
-						tmpPix[0] = unpPix[0] + (float)_value.r;
-					}
-					else if (processG && (c == 1)) {
-						tmpPix[1] = unpPix[1] + (float)_value.g;
-					}
-					else if (processB && (c == 2)) {
-						tmpPix[2] = unpPix[2] + (float)_value.b;
-					}
-					else if (processA && (c == 3)) {
-						tmpPix[3] = unpPix[3] + (float)_value.a;
-					}
-					else {
-						tmpPix[c] = unpPix[c];
+			return;
+		}
+		// pixels of the render window that are outside of the source bounds
+		OfxRectI band;
+		band = procWindow; band.y2 = srcWindow.y1; // bottom
+		processNoSource<processR, processG, processB, processA>(band);
+		band = procWindow; band.y1 = srcWindow.y2; // top
+		processNoSource<processR, processG, processB, processA>(band);
+		band = srcWindow; band.x1 = procWindow.x1; band.x2 = srcWindow.x1; // left
+		processNoSource<processR, processG, processB, processA>(band);
+		band = srcWindow; band.x1 = srcWindow.x2; band.x2 = procWindow.x2; // right
+		processNoSource<processR, processG, processB, processA>(band);
+
+		blur<processR, processG, processB, processA>(srcWindow,
+			BoxBlur::radiusPixels(_size, rs.x),
+			BoxBlur::radiusPixels(_size, rs.y));
+	}
+
+	/* box blur of a window that lies inside the source bounds. The source is extended by its edge pixels. */
+	template<bool processR, bool processG, bool processB, bool processA>
+	void blur(const OfxRectI& window, int rx, int ry)
+	{
+		const OfxRectI& bounds = _srcImg->getBounds();
+		std::vector<float> line(((std::min)(window.x2 - window.x1, BoxBlur::stripWidth<nComponents>()) + 2 * rx) * nComponents);
+		const float k = 1.f / maxValue;
+
+		BoxBlur::blurStrips<nComponents>(window.x1, window.x2, window.y1, window.y2, ry, bounds.y1, bounds.y2,
+			[&](int x1, int x2, int y, float* out) {
+				const int width = x2 - x1;
+				const PIX* srcRow = (const PIX*)_srcImg->getPixelAddress(bounds.x1, y);
+				for (int i = 0; i < width + 2 * rx; ++i) {
+					const int x = (std::max)(bounds.x1, (std::min)(x1 - rx + i, bounds.x2 - 1));
+					// the premultiplied values are filtered, so that transparent pixels do not darken their neighbours
+					const PIX* srcPix = srcRow + (x - bounds.x1) * nComponents;
+					for (int c = 0; c < nComponents; ++c) {
+						line[i * nComponents + c] = srcPix[c] * k;
 					}
 				}
-				ofxsPremultMaskMixPix<PIX, nComponents, maxValue, true>(tmpPix, _premult, _premultChannel, x, y, srcPix, _doMasking, _maskImg, (float)_mix, _maskInvert, dstPix);
-				// copy back original values from unprocessed channels
-				if (nComponents == 1) {
-					if (!processA) {
-						dstPix[0] = srcPix ? srcPix[0] : PIX();
-					}
+				BoxBlur::blurRow<nComponents>(&line[0], width, rx, out);
+			},
+			[&](int x1, int x2, int y, const float* values) {
+				const int width = x2 - x1;
+				const PIX* srcPix = (const PIX*)_srcImg->getPixelAddress(x1, y);
+				PIX* dstPix = (PIX*)_dstImg->getPixelAddress(x1, y);
+				for (int i = 0; i < width; ++i) {
+					writePixel<processR, processG, processB, processA>(values + i * nComponents, x1 + i, y, srcPix + i * nComponents, dstPix + i * nComponents);
 				}
-				else if ((nComponents == 3) || (nComponents == 4)) {
-					if (!processR) {
-						dstPix[0] = srcPix ? srcPix[0] : PIX();
-					}
-					if (!processG) {
-						dstPix[1] = srcPix ? srcPix[1] : PIX();
-					}
-					if (!processB) {
-						dstPix[2] = srcPix ? srcPix[2] : PIX();
-					}
-					if (!processA && (nComponents == 4)) {
-						dstPix[3] = srcPix ? srcPix[3] : PIX();
-					}
+				copyUnprocessedChannels<processR, processG, processB, processA>(srcPix, dstPix, width);
+			},
+			_cancel);
+	}
+
+	/* alpha is 1 inside of the plates (everywhere if detection is off), 0 elsewhere.
+	   The colour is not multiplied by the mask, so the plugin marks the output as unpremultiplied:
+	   premultiplied colour is first divided by the alpha it was premultiplied with. */
+	void writePlateMask(const OfxRectI& window)
+	{
+		const PIX one = (maxValue == 1) ? PIX(1) : std::numeric_limits<PIX>::max();
+		const bool unpremult = _premult && (_premultChannel >= 0) && (_premultChannel <= 3);
+		for (int y = window.y1; y < window.y2; y++) {
+			if (aborted()) {
+				break;
+			}
+
+			PIX* dstRow = (PIX*)_dstImg->getPixelAddress(window.x1, y);
+			if (unpremult) {
+				unpremultiplyRow(dstRow, window.x2 - window.x1, one);
+			}
+			const PIX outside = _plates ? PIX() : one;
+			for (int x = 0; x < window.x2 - window.x1; x++) {
+				dstRow[x * nComponents + 3] = outside;
+			}
+			if (!_plates) {
+				continue;
+			}
+			for (std::vector<OfxRectI>::const_iterator it = _plates->begin(); it != _plates->end(); ++it) {
+				if ((y < it->y1) || (y >= it->y2)) {
+					continue;
+				}
+				const int x2 = (std::min)(window.x2, it->x2);
+				for (int x = (std::max)(window.x1, it->x1); x < x2; x++) {
+					dstRow[(x - window.x1) * nComponents + 3] = one;
 				}
-				// increment the dst pixel
+			}
+		}
+	}
+
+	/* divide the colour of count premultiplied pixels by their alpha, the premultiplication channel */
+	void unpremultiplyRow(PIX* pix, int count, PIX one) const
+	{
+		for (int x = 0; x < count; ++x) {
+			PIX* p = pix + x * nComponents;
+			const float alpha = (float)p[_premultChannel];
+			if (alpha <= FLT_EPSILON) {
+				continue;
+			}
+			const float k = (float)one / alpha;
+			for (int c = 0; c < 3; ++c) {
+				const float v = p[c] * k;
+				p[c] = (maxValue == 1) ? PIX(v) : (v >= (float)one) ? one : PIX(v + 0.5f);
+			}
+		}
+	}
+
+	/* copy the source pixels, black and transparent outside of the source bounds */
+	void copySource(const OfxRectI& window)
+	{
+		const OfxRectI* bounds = _srcImg ? &_srcImg->getBounds() : NULL;
+		for (int y = window.y1; y < window.y2; y++) {
+			if (aborted()) {
+				break;
+			}
+
+			PIX* dstPix = (PIX*)_dstImg->getPixelAddress(window.x1, y);
+			std::fill(dstPix, dstPix + (window.x2 - window.x1) * nComponents, PIX());
+			if (!bounds || (y < bounds->y1) || (y >= bounds->y2)) {
+				continue;
+			}
+			const int x1 = (std::max)(window.x1, bounds->x1);
+			const int x2 = (std::min)(window.x2, bounds->x2);
+			if (x1 < x2) {
+				const PIX* srcPix = (const PIX*)_srcImg->getPixelAddress(x1, y);
+				std::copy(srcPix, srcPix + (x2 - x1) * nComponents, dstPix + (x1 - window.x1) * nComponents);
+			}
+		}
+	}
+
+	/* pixels without a source pixel: black and transparent */
+	template<bool processR, bool processG, bool processB, bool processA>
+	void processNoSource(const OfxRectI& window)
+	{
+		const float zero[nComponents] = {};
+		for (int y = window.y1; y < window.y2; y++) {
+			if (aborted()) {
+				break;
+			}
+
+			PIX* dstRow = (PIX*)_dstImg->getPixelAddress(window.x1, y);
+			PIX* dstPix = dstRow;
+
+			for (int x = window.x1; x < window.x2; x++) {
+				writePixel<processR, processG, processB, processA>(zero, x, y, NULL, dstPix);
 				dstPix += nComponents;
 			}
+			copyUnprocessedChannels<processR, processG, processB, processA>(NULL, dstRow, window.x2 - window.x1);
+		}
+	}
+
+	/* restore the channels that are not processed over a span of count pixels, one strided copy per channel.
+	   The channel selection is known at compile time, so there is no per-pixel branch. */
+	template<bool processR, bool processG, bool processB, bool processA>
+	static void copyUnprocessedChannels(const PIX* srcPix, PIX* dstPix, int count)
+	{
+		for (int c = 0; c < nComponents; ++c) {
+			const bool processed = (nComponents == 1) ? processA :
+				(c == 0) ? processR : (c == 1) ? processG : (c == 2) ? processB : processA;
+			if (processed) {
+				continue;
+			}
+			if (srcPix) {
+				for (int i = 0; i < count; ++i) {
+					dstPix[i * nComponents + c] = srcPix[i * nComponents + c];
+				}
+			}
+			else {
+				for (int i = 0; i < count; ++i) {
+					dstPix[i * nComponents + c] = PIX();
+				}
+			}
+		}
+	}
+
+	/* write one filtered (premultiplied) pixel. The unprocessed channels are restored afterwards, see copyUnprocessedChannels(). */
+	template<bool processR, bool processG, bool processB, bool processA>
+	void writePixel(const float* v, int x, int y, const PIX* srcPix, PIX* dstPix)
+	{
+		float tmpPix[4] = { 0.f, 0.f, 0.f, 0.f };
+		if (nComponents == 1) {
+			tmpPix[3] = v[0];
+		}
+		else {
+			for (int c = 0; c < nComponents; ++c) {
+				tmpPix[c] = v[c];
+			}
+		}
+		// the value is added to the colour, which is premultiplied again below
+		const float alpha = (_premult && (nComponents == 4) && (_premultChannel >= 0) && (_premultChannel <= 3)) ? tmpPix[_premultChannel] : 0.f;
+		if (alpha > FLT_EPSILON) {
+			for (int c = 0; c < 3; ++c) {
+				tmpPix[c] /= alpha;
+			}
+		}
+		if (processR) {
+			tmpPix[0] += (float)_value.r;
+		}
+		if (processG) {
+			tmpPix[1] += (float)_value.g;
+		}
+		if (processB) {
+			tmpPix[2] += (float)_value.b;
+		}
+		if (processA) {
+			tmpPix[3] += (float)_value.a;
 		}
+		ofxsPremultMaskMixPix<PIX, nComponents, maxValue, true>(tmpPix, _premult, _premultChannel, x, y, srcPix, _doMasking, _maskImg, (float)_mix, _maskInvert, dstPix);
 	}
 };
 
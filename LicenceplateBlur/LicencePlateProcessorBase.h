@@ -1,8 +1,13 @@
 #ifndef LICENCEPLATEPROCESSORBASE_H
 #define LICENCEPLATEPROCESSORBASE_H
 
+#include <algorithm>
+#include <vector>
+
 #include "RGBAValues.h"
+#include "Cancellation.h"
 #include "ofxsProcessing.H"
+#include "ofxsMacros.h"
 
 using namespace OFX;
 
@@ -17,11 +22,15 @@ protected:
 	bool _processB;
 	bool _processA;
 	RGBAValues _value;
+	double _size;
 	bool _premult;
 	int _premultChannel;
 	bool _doMasking;
 	double _mix;
 	bool _maskInvert;
+	const std::vector<OfxRectI>* _plates;
+	Cancellation* _cancel;
+	bool _plateMask;
 
 public:
 
@@ -34,11 +43,15 @@ public:
 		, _processB(true)
 		, _processA(false)
 		, _value()
+		, _size(0.)
 		, _premult(false)
 		, _premultChannel(3)
 		, _doMasking(false)
 		, _mix(1.)
 		, _maskInvert(false)
+		, _plates(nullptr)
+		, _cancel(nullptr)
+		, _plateMask(false)
 	{
 	}
 
@@ -52,6 +65,70 @@ public:
 		_maskImg = v; _maskInvert = maskInvert;
 	}
 
+	/** @brief only process these regions, and copy the source elsewhere. If NULL, the whole render window is processed. */
+	void setPlates(const std::vector<OfxRectI>* v)
+	{
+		_plates = v;
+	}
+
+	using ImageProcessor::process;
+
+	/** @brief process the render window with at most maxThreads threads (0 means no limit).
+	 *
+	 * When several frames are rendered concurrently on the same instance, splitting
+	 * each frame over all the CPUs only oversubscribes them. As in ImageProcessor::process(),
+	 * each thread gets at least 4096 pixels, so small tiles are not split at all.
+	 */
+	void process(unsigned int maxThreads)
+	{
+		const int width = _renderWindow.x2 - _renderWindow.x1;
+		const int height = _renderWindow.y2 - _renderWindow.y1;
+		if (!_dstImg || (width <= 0) || (height <= 0)) {
+			return;
+		}
+		preProcess();
+		unsigned int nThreads = (unsigned int)(((size_t)(std::min)(width, 4096) * height) / 4096);
+		nThreads = (std::min)(nThreads, MultiThread::getNumCPUs());
+		if (maxThreads > 0) {
+			nThreads = (std::min)(nThreads, maxThreads);
+		}
+		// the threads get bands of columns, see multiThreadFunction()
+		nThreads = (std::max)(1u, (std::min)(nThreads, (unsigned int)width));
+		multiThread(nThreads);
+		postProcess();
+	}
+
+	/** @brief the render window is cut into bands of columns rather than of rows.
+	 *
+	 * The vertical pass of the blur keeps one running sum per column, so a band
+	 * of columns filters each of its rows once, and only reads radius extra pixels
+	 * on each side of them. A band of rows would filter the 2 * radius full rows
+	 * around it again.
+	 */
+	void multiThreadFunction(unsigned int threadId, unsigned int nThreads) OVERRIDE
+	{
+		const unsigned int dx = (_renderWindow.x2 > _renderWindow.x1) ? (unsigned int)(_renderWindow.x2 - _renderWindow.x1) : 0;
+		const unsigned int w = (std::max)(1u, (dx + nThreads - 1) / nThreads);
+		OfxRectI win = _renderWindow;
+		win.x1 = _renderWindow.x1 + (int)(std::min)(dx, threadId * w);
+		win.x2 = _renderWindow.x1 + (int)(std::min)(dx, (threadId + 1) * w);
+		if (win.x1 < win.x2) {
+			multiThreadProcessImages(win, _renderScale);
+		}
+	}
+
+	/** @brief replace the alpha channel of RGBA images by a mask of the plates */
+	void setPlateMask(bool v)
+	{
+		_plateMask = v;
+	}
+
+	/** @brief cancellation shared by all the stages of this render. If NULL, the host is polled directly. */
+	void setCancellation(Cancellation* v)
+	{
+		_cancel = v;
+	}
+
 	void doMasking(bool v) {
 		_doMasking = v;
 	}
@@ -61,6 +138,7 @@ public:
 		bool processB,
 		bool processA,
 		const RGBAValues& value,
+		double size,
 		bool premult,
 		int premultChannel,
 		double mix)
@@ -70,11 +148,19 @@ public:
 		_processB = processB;
 		_processA = processA;
 		_value = value;
+		_size = size;
 		_premult = premult;
 		_premultChannel = premultChannel;
 		_mix = mix;
 	}
 
+protected:
+	/* cancellation checkpoint, cheap enough to be called once per row */
+	bool aborted() const
+	{
+		return _cancel ? _cancel->aborted() : _effect.abort();
+	}
+
 private:
 };
 
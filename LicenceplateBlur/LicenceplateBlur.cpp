@@ -23,10 +23,21 @@
 
 #include <cmath>
 #include <cfloat> // DBL_MAX    
+#include <climits> // INT_MAX
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <vector>
+#include <algorithm>
+#include <list>
+#include <string>
 
 #include "LicencePlateProcessorBase.h"
 #include "LicencePlateProcessor.h"
+#include "BoxBlur.h"
+#include "FeaturePlanes.h"
+#include "PlateDetector.h"
+#include "Cancellation.h"
 
 #include "ofxsProcessing.H"
 #include "ofxsMaskMix.h"
@@ -40,6 +51,21 @@
 
 using namespace OFX;
 
+#ifdef OFX_USE_MULTITHREAD_MUTEX
+namespace {
+	typedef MultiThread::Mutex Mutex;
+	typedef MultiThread::AutoMutex AutoMutex;
+}
+#else
+// some OFX hosts do not have mutex handling in the MT-Suite (e.g. Sony Catalyst Edit)
+// prefer using the fast mutex by Marcus Geelnard http://tinythreadpp.sourceforge.net/
+#include "fast_mutex.h"
+namespace {
+	typedef tthread::fast_mutex Mutex;
+	typedef MultiThread::AutoMutexT<tthread::fast_mutex> AutoMutex;
+}
+#endif
+
 OFXS_NAMESPACE_ANONYMOUS_ENTER
 
 #define kPluginName "LicecenceplateBlur"
@@ -95,9 +121,13 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kPluginIdentifier "hu.pezia.openfx.LicenceplateBlur"
 
 // History:
-// version 1.0: initial version
-#define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+// version 1.0: initial version, adds a constant to the selected channels
+// version 2.0: box blur of the selected channels, restricted to the detected plates by default.
+//              Projects made with 1.0 would render differently with the new defaults.
+// version 2.1: plate mask output
+// version 2.2: two-component (XY) images, layer selection
+#define kPluginVersionMajor 2 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
+#define kPluginVersionMinor 2 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -138,6 +168,41 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kParamValueLabel "Value"
 #define kParamValueHint  "Constant to add to the selected channels."
 
+#define kParamSize "size"
+#define kParamSizeLabel "Size"
+#define kParamSizeHint "Radius of the box blur applied to the selected channels, in pixels at full resolution."
+#define kParamSizeDefault 10.
+
+#define kParamDetect "detect"
+#define kParamDetectLabel "Detect Plates"
+#define kParamDetectHint "Only blur the licence plates detected in the source image. When unchecked, the whole image is blurred."
+
+#define kParamEdgeThreshold "edgeThreshold"
+#define kParamEdgeThresholdLabel "Edge Threshold"
+#define kParamEdgeThresholdHint "Minimum horizontal luminance difference, as a fraction of the full range, for a pixel to count as a character edge."
+
+#define kParamEdgeDensity "edgeDensity"
+#define kParamEdgeDensityLabel "Edge Density"
+#define kParamEdgeDensityHint "Minimum fraction of edge pixels in a detection cell for it to be part of a plate."
+
+#define kDetectCellSize 8 // side of a detection cell, in pixels at full resolution
+
+#define kParamPlateMask "plateMask"
+#define kParamPlateMaskLabel "Plate Mask in Alpha"
+#define kParamPlateMaskHint "Replace the alpha channel of RGBA images by a mask of the detected plates (1 inside, 0 outside). " \
+	"Downstream nodes, such as a second redaction pass or a QC overlay, can use it as their mask instead of detecting the plates again. " \
+	"The colour channels are not multiplied by the mask: they are unpremultiplied when (Un)premult is checked, and the output is marked as unpremultiplied."
+
+#define kParamMaxThreads "maxThreads"
+#define kParamMaxThreadsLabel "Threads per Frame"
+#define kParamMaxThreadsHint "Maximum number of threads used to render one frame, 0 meaning all the CPUs. " \
+	"When the host renders several frames in parallel, set it to the number of CPUs divided by the number of frames rendered at once."
+
+#define kPlateCacheSize 16 // number of frames for which the detected plates are kept
+
+// when this environment variable is set, aborted renders report on stderr how long they took to return
+#define kAbortLogEnv "LICENCEPLATEBLUR_ABORT_LOG"
+
 #define kParamPremultChanged "premultChanged"
 
 #ifdef OFX_EXTENSIONS_NATRON
@@ -147,6 +212,134 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #endif
 
 
+// on stderr, because the log file of the support library is only written in DEBUG builds
+static void
+logAbort(const char* stage, double time, const Cancellation& cancel)
+{
+	static const bool enabled = (std::getenv(kAbortLogEnv) != NULL);
+	if (enabled) {
+		std::fprintf(stderr, "%s: render aborted at time %g during %s, returned at most %.2f ms after the abort\n",
+			kPluginIdentifier, time, stage, cancel.millisecondsSinceAbort());
+	}
+}
+
+template <class PIX, int maxValue>
+static bool
+computeImageFeaturePlanes(const Image& img, FeaturePlanes* planes, Cancellation* cancel)
+{
+	const OfxRectI& b = img.getBounds();
+	const void* data = img.getPixelAddress(b.x1, b.y1);
+
+	switch (img.getPixelComponentCount()) {
+	case 1:
+		return computeFeaturePlanes<PIX, 1, maxValue>(data, img.getRowBytes(), b.x1, b.y1, b.x2, b.y2, planes, cancel);
+	case 2:
+		return computeFeaturePlanes<PIX, 2, maxValue>(data, img.getRowBytes(), b.x1, b.y1, b.x2, b.y2, planes, cancel);
+	case 3:
+		return computeFeaturePlanes<PIX, 3, maxValue>(data, img.getRowBytes(), b.x1, b.y1, b.x2, b.y2, planes, cancel);
+	case 4:
+		return computeFeaturePlanes<PIX, 4, maxValue>(data, img.getRowBytes(), b.x1, b.y1, b.x2, b.y2, planes, cancel);
+	default:
+		throwSuiteStatusException(kOfxStatErrUnsupported);
+	}
+
+	return false;
+}
+
+/* compute the detection planes from the whole image, whatever its depth and components. Returns false if cancelled. */
+static bool
+computeImageFeaturePlanes(const Image& img, FeaturePlanes* planes, Cancellation* cancel)
+{
+	switch (img.getPixelDepth()) {
+	case eBitDepthUByte:
+		return computeImageFeaturePlanes<unsigned char, 255>(img, planes, cancel);
+	case eBitDepthUShort:
+		return computeImageFeaturePlanes<unsigned short, 65535>(img, planes, cancel);
+	case eBitDepthFloat:
+		return computeImageFeaturePlanes<float, 1>(img, planes, cancel);
+	default:
+		throwSuiteStatusException(kOfxStatErrUnsupported);
+	}
+
+	return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/** @brief the plates detected in the most recently rendered source images.
+ *
+ * Render is called concurrently for several frames (and for several tiles of
+ * the same frame) on one instance, so all accesses are serialized. Detection
+ * itself runs outside of the lock: two renders missing the same entry both
+ * detect, and the first one to finish fills the entry.
+ */
+class PlateCache
+{
+public:
+	struct Key
+	{
+		std::string srcId; // unique identifier of the source image
+		double time;
+		OfxPointD renderScale;
+		int cellSize;
+		int edgeThreshold;
+		double edgeDensity;
+
+		bool operator==(const Key& other) const
+		{
+			return srcId == other.srcId && time == other.time &&
+				renderScale.x == other.renderScale.x && renderScale.y == other.renderScale.y &&
+				cellSize == other.cellSize && edgeThreshold == other.edgeThreshold && edgeDensity == other.edgeDensity;
+		}
+	};
+
+	bool get(const Key& key, std::vector<OfxRectI>* plates)
+	{
+		AutoMutex lock(_mutex);
+		for (std::list<Entry>::iterator it = _entries.begin(); it != _entries.end(); ++it) {
+			if (it->key == key) {
+				*plates = it->plates;
+				_entries.splice(_entries.begin(), _entries, it); // most recently used first
+
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	void add(const Key& key, const std::vector<OfxRectI>& plates)
+	{
+		AutoMutex lock(_mutex);
+		for (std::list<Entry>::iterator it = _entries.begin(); it != _entries.end(); ++it) {
+			if (it->key == key) {
+				return;
+			}
+		}
+		_entries.push_front(Entry());
+		_entries.front().key = key;
+		_entries.front().plates = plates;
+		if (_entries.size() > kPlateCacheSize) {
+			_entries.pop_back();
+		}
+	}
+
+	void clear()
+	{
+		AutoMutex lock(_mutex);
+		_entries.clear();
+	}
+
+private:
+	struct Entry
+	{
+		Key key;
+		std::vector<OfxRectI> plates;
+	};
+
+	Mutex _mutex;
+	std::list<Entry> _entries;
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 /** @brief The plugin that does our work */
 class LicencePlateBlurPlugin
@@ -164,6 +357,12 @@ public:
 		, _processB(NULL)
 		, _processA(NULL)
 		, _value(NULL)
+		, _size(NULL)
+		, _detect(NULL)
+		, _edgeThreshold(NULL)
+		, _edgeDensity(NULL)
+		, _maxThreads(NULL)
+		, _plateMask(NULL)
 		, _premult(NULL)
 		, _premultChannel(NULL)
 		, _mix(NULL)
@@ -186,6 +385,16 @@ public:
 		assert(_processR && _processG && _processB && _processA);
 		_value = fetchRGBAParam(kParamValueName);
 		assert(_value);
+		_size = fetchDoubleParam(kParamSize);
+		assert(_size);
+		_detect = fetchBooleanParam(kParamDetect);
+		_edgeThreshold = fetchDoubleParam(kParamEdgeThreshold);
+		_edgeDensity = fetchDoubleParam(kParamEdgeDensity);
+		assert(_detect && _edgeThreshold && _edgeDensity);
+		_maxThreads = fetchIntParam(kParamMaxThreads);
+		assert(_maxThreads);
+		_plateMask = fetchBooleanParam(kParamPlateMask);
+		assert(_plateMask);
 		_premult = fetchBooleanParam(kParamPremult);
 		_premultChannel = fetchChoiceParam(kParamPremultChannel);
 		assert(_premult && _premultChannel);
@@ -202,10 +411,17 @@ private:
 	virtual void render(const RenderArguments& args) OVERRIDE FINAL;
 
 	template <int nComponents>
-	void renderInternal(const RenderArguments& args, BitDepthEnum dstBitDepth);
+	void renderInternal(const RenderArguments& args, Image* dst);
+
+	/* detect the plates in the whole colour image. Returns false if the render was aborted. */
+	bool detectPlates(const Image& colour, const RenderArguments& args, Cancellation* cancel, std::vector<OfxRectI>* plates);
 
 	/* set up and run a processor */
-	void setupAndProcess(LicencePlateProcessorBase&, const RenderArguments& args);
+	void setupAndProcess(LicencePlateProcessorBase&, const RenderArguments& args, Image* dst);
+
+	virtual void getRegionsOfInterest(const RegionsOfInterestArguments& args, RegionOfInterestSetter& rois) OVERRIDE FINAL;
+
+	virtual void getClipPreferences(ClipPreferencesSetter& clipPreferences) OVERRIDE FINAL;
 
 	virtual bool isIdentity(const IsIdentityArguments& args, Clip*& identityClip, double& identityTime, int& view, std::string& plane) OVERRIDE FINAL;
 
@@ -213,6 +429,8 @@ private:
 	virtual void changedClip(const InstanceChangedArgs& args, const std::string& clipName) OVERRIDE FINAL;
 	virtual void changedParam(const InstanceChangedArgs& args, const std::string& paramName) OVERRIDE FINAL;
 
+	virtual void purgeCaches() OVERRIDE FINAL;
+
 private:
 	// do not need to delete these, the ImageEffect is managing them for us
 	Clip* _dstClip;
@@ -223,12 +441,19 @@ private:
 	BooleanParam* _processB;
 	BooleanParam* _processA;
 	RGBAParam* _value;
+	DoubleParam* _size;
+	BooleanParam* _detect;
+	DoubleParam* _edgeThreshold;
+	DoubleParam* _edgeDensity;
+	IntParam* _maxThreads;
+	BooleanParam* _plateMask;
 	BooleanParam* _premult;
 	ChoiceParam* _premultChannel;
 	DoubleParam* _mix;
 	BooleanParam* _maskApply;
 	BooleanParam* _maskInvert;
 	BooleanParam* _premultChanged; // set to true the first time the user connects src
+	PlateCache _plateCache;
 };
 
 
@@ -238,32 +463,62 @@ private:
 ////////////////////////////////////////////////////////////////////////////////
 // basic plugin render function, just a skelington to instantiate templates from
 
-/* set up and run a processor */
-void LicencePlateBlurPlugin::setupAndProcess(LicencePlateProcessorBase& processor, const RenderArguments& args)
+bool LicencePlateBlurPlugin::detectPlates(const Image& colour, const RenderArguments& args, Cancellation* cancel, std::vector<OfxRectI>* plates)
 {
-	auto_ptr<Image> dst(_dstClip->fetchImage(args.time));
+	PlateDetectorParams params;
+	params.cellSize = (std::max)(2, (int)std::floor(kDetectCellSize * args.renderScale.x + 0.5));
+	params.edgeThreshold = (int)std::floor(_edgeThreshold->getValueAtTime(args.time) * 255. + 0.5);
+	params.edgeDensity = _edgeDensity->getValueAtTime(args.time);
+
+	// the tiles of a frame, and the renders of its other layers, share the same colour image: detect only once
+	PlateCache::Key key;
+	key.srcId = colour.getUniqueIdentifier();
+	key.time = args.time;
+	key.renderScale = args.renderScale;
+	key.cellSize = params.cellSize;
+	key.edgeThreshold = params.edgeThreshold;
+	key.edgeDensity = params.edgeDensity;
+	// without an identifier, the host may give different images for the same time
+	const bool cached = !key.srcId.empty();
+	if (cached && _plateCache.get(key, plates)) {
+		return true;
+	}
 
-	if (!dst.get()) {
-		throwSuiteStatusException(kOfxStatFailed);
+	// the source is converted once, all detection stages read the planes
+	FeaturePlanes planes;
+	if (!computeImageFeaturePlanes(colour, &planes, cancel)) {
+		return false;
 	}
-# ifndef NDEBUG
-	BitDepthEnum dstBitDepth = dst->getPixelDepth();
-	PixelComponentEnum dstComponents = dst->getPixelComponents();
-	if ((dstBitDepth != _dstClip->getPixelDepth()) ||
-		(dstComponents != _dstClip->getPixelComponents())) {
-		setPersistentMessage(Message::eMessageError, "", "OFX Host gave image with wrong depth or components");
-		throwSuiteStatusException(kOfxStatFailed);
+
+	PlateDetector detector(params);
+	std::vector<PlateRect> found;
+	if (!detector.detect(planes, &found, cancel)) {
+		// nothing partial goes to the cache
+		return false;
 	}
-	checkBadRenderScaleOrField(dst, args);
-# endif
+
+	plates->clear();
+	for (std::vector<PlateRect>::const_iterator it = found.begin(); it != found.end(); ++it) {
+		OfxRectI r = { it->x1, it->y1, it->x2, it->y2 };
+		plates->push_back(r);
+	}
+	if (cached) {
+		_plateCache.add(key, *plates);
+	}
+
+	return true;
+}
+
+/* set up and run a processor */
+void LicencePlateBlurPlugin::setupAndProcess(LicencePlateProcessorBase& processor, const RenderArguments& args, Image* dst)
+{
 	auto_ptr<const Image> src((_srcClip && _srcClip->isConnected()) ?
 		_srcClip->fetchImage(args.time) : 0);
 # ifndef NDEBUG
 	if (src.get()) {
 		checkBadRenderScaleOrField(src, args);
-		BitDepthEnum srcBitDepth = src->getPixelDepth();
-		PixelComponentEnum srcComponents = src->getPixelComponents();
-		if ((srcBitDepth != dstBitDepth) || (srcComponents != dstComponents)) {
+		if ((src->getPixelDepth() != dst->getPixelDepth()) ||
+			(src->getPixelComponentCount() != dst->getPixelComponentCount())) {
 			throwSuiteStatusException(kOfxStatErrImageFormat);
 		}
 	}
@@ -279,8 +534,41 @@ void LicencePlateBlurPlugin::setupAndProcess(LicencePlateProcessorBase& processo
 	}
 
 	// set the images
-	processor.setDstImg(dst.get());
+	processor.setDstImg(dst);
 	processor.setSrcImg(src.get());
+
+	// all the stages of this render stop within a few milliseconds of an abort
+	Cancellation cancel([this] { return abort(); });
+	processor.setCancellation(&cancel);
+
+	std::vector<OfxRectI> plates;
+	if (_detect->getValueAtTime(args.time)) {
+		if (src.get()) {
+			const Image* colour = src.get();
+#ifdef OFX_EXTENSIONS_NUKE
+			// the host's layer selector gives the selected layer (e.g. depth or motion vectors), which has no
+			// visible plates: they are detected on the colour plane of the same frame, and blurred on the layer
+			auto_ptr<const Image> colourPlane;
+			if (src->getPixelComponents() == ePixelComponentCustom) {
+				colourPlane.reset(_srcClip->fetchImagePlane(args.time, args.renderView, kFnOfxImagePlaneColour));
+				if (!colourPlane.get()) {
+					// never output a layer with unredacted plates
+					setPersistentMessage(Message::eMessageError, "", "Could not fetch the colour plane to detect the plates of the selected layer");
+					throwSuiteStatusException(kOfxStatFailed);
+				}
+				colour = colourPlane.get();
+			}
+#endif
+			if (!detectPlates(*colour, args, &cancel, &plates)) {
+				logAbort("detection", args.time, cancel);
+
+				return;
+			}
+		}
+		processor.setPlates(&plates);
+	}
+	// only the alpha channel of a colour image is replaced, never the fourth channel of another layer
+	processor.setPlateMask(_plateMask->getValueAtTime(args.time) && (dst->getPixelComponents() == ePixelComponentRGBA));
 	// set the render window
 	processor.setRenderWindow(args.renderWindow, args.renderScale);
 
@@ -291,6 +579,8 @@ void LicencePlateBlurPlugin::setupAndProcess(LicencePlateProcessorBase& processo
 	_processA->getValueAtTime(args.time, processA);
 	RGBAValues value;
 	_value->getValueAtTime(args.time, value.r, value.g, value.b, value.a);
+	double size;
+	_size->getValueAtTime(args.time, size);
 	bool premult;
 	int premultChannel;
 	_premult->getValueAtTime(args.time, premult);
@@ -298,30 +588,34 @@ void LicencePlateBlurPlugin::setupAndProcess(LicencePlateProcessorBase& processo
 	double mix;
 	_mix->getValueAtTime(args.time, mix);
 	processor.setValues(processR, processG, processB, processA,
-		value, premult, premultChannel, mix);
+		value, size, premult, premultChannel, mix);
 
 	// Call the base class process member, this will call the derived templated process code
-	processor.process();
+	processor.process((unsigned int)(std::max)(0, _maxThreads->getValueAtTime(args.time)));
+
+	if (cancel.wasAborted()) {
+		logAbort("processing", args.time, cancel);
+	}
 }
 
 // the internal render function
 template <int nComponents>
-void LicencePlateBlurPlugin::renderInternal(const RenderArguments& args, BitDepthEnum dstBitDepth)
+void LicencePlateBlurPlugin::renderInternal(const RenderArguments& args, Image* dst)
 {
-	switch (dstBitDepth) {
+	switch (dst->getPixelDepth()) {
 	case eBitDepthUByte: {
 		LicencePlateProcessor<unsigned char, nComponents, 255> fred(*this);
-		setupAndProcess(fred, args);
+		setupAndProcess(fred, args, dst);
 		break;
 	}
 	case eBitDepthUShort: {
 		LicencePlateProcessor<unsigned short, nComponents, 65536> fred(*this);
-		setupAndProcess(fred, args);
+		setupAndProcess(fred, args, dst);
 		break;
 	}
 	case eBitDepthFloat: {
 		LicencePlateProcessor<float, nComponents, 1> fred(*this);
-		setupAndProcess(fred, args);
+		setupAndProcess(fred, args, dst);
 		break;
 	}
 	default:
@@ -331,31 +625,72 @@ void LicencePlateBlurPlugin::renderInternal(const RenderArguments& args, BitDept
 
 // the overridden render function
 void LicencePlateBlurPlugin::render(const RenderArguments& args) {
-	// instantiate the render code based on the pixel depth of the dst clip
-	BitDepthEnum dstBitDepth = _dstClip->getPixelDepth();
-	PixelComponentEnum dstComponents = _dstClip->getPixelComponents();
-
 	assert(kSupportsMultipleClipPARs || !_srcClip || !_srcClip->isConnected() || _srcClip->getPixelAspectRatio() == _dstClip->getPixelAspectRatio());
 	assert(kSupportsMultipleClipDepths || !_srcClip || !_srcClip->isConnected() || _srcClip->getPixelDepth() == _dstClip->getPixelDepth());
-#ifdef OFX_EXTENSIONS_NATRON
-	assert(dstComponents == ePixelComponentRGBA || dstComponents == ePixelComponentRGB || dstComponents == ePixelComponentXY || dstComponents == ePixelComponentAlpha);
-#else
-	assert(dstComponents == ePixelComponentRGBA || dstComponents == ePixelComponentRGB || dstComponents == ePixelComponentAlpha);
-#endif
-	if (dstComponents == ePixelComponentRGBA) {
-		renderInternal<4>(args, dstBitDepth);
+
+	// the image may be another layer than the clip components, selected by the host:
+	// instantiate the render code based on the depth and number of components of the image itself
+	auto_ptr<Image> dst(_dstClip->fetchImage(args.time));
+
+	if (!dst.get()) {
+		throwSuiteStatusException(kOfxStatFailed);
 	}
-	else if (dstComponents == ePixelComponentRGB) {
-		renderInternal<3>(args, dstBitDepth);
-#ifdef OFX_EXTENSIONS_NATRON
+# ifndef NDEBUG
+	if (dst->getPixelDepth() != _dstClip->getPixelDepth()) {
+		setPersistentMessage(Message::eMessageError, "", "OFX Host gave image with wrong depth");
+		throwSuiteStatusException(kOfxStatFailed);
 	}
-	else if (dstComponents == ePixelComponentXY) {
-		renderInternal<2>(args, dstBitDepth);
-#endif
+	checkBadRenderScaleOrField(dst, args);
+# endif
+	switch (dst->getPixelComponentCount()) {
+	case 4:
+		renderInternal<4>(args, dst.get());
+		break;
+	case 3:
+		renderInternal<3>(args, dst.get());
+		break;
+	case 2:
+		renderInternal<2>(args, dst.get());
+		break;
+	case 1:
+		renderInternal<1>(args, dst.get());
+		break;
+	default:
+		throwSuiteStatusException(kOfxStatErrUnsupported);
+	}
+}
+
+// the blur reads source pixels up to the blur radius away from the rendered region
+void LicencePlateBlurPlugin::getRegionsOfInterest(const RegionsOfInterestArguments& args, RegionOfInterestSetter& rois)
+{
+	if (!_srcClip || !_srcClip->isConnected()) {
+		return;
 	}
-	else {
-		assert(dstComponents == ePixelComponentAlpha);
-		renderInternal<1>(args, dstBitDepth);
+	if (_detect->getValueAtTime(args.time)) {
+		// detection needs the whole source image
+		rois.setRegionOfInterest(*_srcClip, _srcClip->getRegionOfDefinition(args.time));
+
+		return;
+	}
+	double size;
+	_size->getValueAtTime(args.time, size);
+	const double par = _srcClip->getPixelAspectRatio();
+	OfxRectD srcRoI = args.regionOfInterest;
+	const double dx = BoxBlur::radiusPixels(size, args.renderScale.x) * par / args.renderScale.x;
+	const double dy = BoxBlur::radiusPixels(size, args.renderScale.y) / args.renderScale.y;
+	srcRoI.x1 -= dx;
+	srcRoI.x2 += dx;
+	srcRoI.y1 -= dy;
+	srcRoI.y2 += dy;
+	rois.setRegionOfInterest(*_srcClip, srcRoI);
+}
+
+void LicencePlateBlurPlugin::getClipPreferences(ClipPreferencesSetter& clipPreferences)
+{
+	// the plate mask replaces alpha, and the processor unpremultiplies the colour:
+	// it must not be unpremultiplied by the mask downstream
+	if (_plateMask->getValue() && _srcClip && _srcClip->isConnected() && (_srcClip->getPixelComponents() == ePixelComponentRGBA)) {
+		clipPreferences.setOutputPremultiplication(eImageUnPreMultiplied);
 	}
 }
 
@@ -363,6 +698,11 @@ bool LicencePlateBlurPlugin::isIdentity(const IsIdentityArguments& args, Clip*&
 	double& /*identityTime*/
 	, int& /*view*/, std::string& /*plane*/)
 {
+	// the plate mask replaces the alpha channel, whatever the other parameters
+	if (_plateMask->getValueAtTime(args.time) && (_dstClip->getPixelComponents() == ePixelComponentRGBA)) {
+		return false;
+	}
+
 	double mix;
 
 	_mix->getValueAtTime(args.time, mix);
@@ -381,7 +721,16 @@ bool LicencePlateBlurPlugin::isIdentity(const IsIdentityArguments& args, Clip*&
 		_processA->getValueAtTime(args.time, processA);
 		RGBAValues value;
 		_value->getValueAtTime(args.time, value.r, value.g, value.b, value.a);
-		if ((!processR || (value.r == 0.)) &&
+		double size;
+		_size->getValueAtTime(args.time, size);
+		const bool blurs = (BoxBlur::radiusPixels(size, args.renderScale.x) > 0) || (BoxBlur::radiusPixels(size, args.renderScale.y) > 0);
+		if (!processR && !processG && !processB && !processA) {
+			identityClip = _srcClip;
+
+			return true;
+		}
+		if (!blurs &&
+			(!processR || (value.r == 0.)) &&
 			(!processG || (value.g == 0.)) &&
 			(!processB || (value.b == 0.)) &&
 			(!processA || (value.a == 0.))) {
@@ -446,6 +795,11 @@ void LicencePlateBlurPlugin::changedParam(const InstanceChangedArgs& args, const
 	}
 }
 
+void LicencePlateBlurPlugin::purgeCaches()
+{
+	_plateCache.clear();
+}
+
 mDeclarePluginFactory(LicencePlateBlurPluginFactory, { ofxsThreadSuiteCheck(); }, {});
 void LicencePlateBlurPluginFactory::describe(ImageEffectDescriptor& desc)
 {
@@ -472,8 +826,11 @@ void LicencePlateBlurPluginFactory::describe(ImageEffectDescriptor& desc)
 	desc.setSupportsMultipleClipDepths(kSupportsMultipleClipDepths);
 	desc.setRenderThreadSafety(kRenderThreadSafety);
 
-#ifdef OFX_EXTENSIONS_NATRON
-	desc.setChannelSelector(ePixelComponentNone); // we have our own channel selector
+#if defined(OFX_EXTENSIONS_NATRON) && defined(OFX_EXTENSIONS_NUKE)
+	// the host's layer selector picks the plane to redact (e.g. a motion vector or depth pass),
+	// and it is given to render as an image with 1 to 4 components. The channels are selected by our own parameters.
+	// The plates are still detected on the colour plane, which is fetched with the multi-plane suite.
+	desc.setChannelSelector(ePixelComponentRGBA);
 #endif
 }
 
@@ -485,6 +842,9 @@ void LicencePlateBlurPluginFactory::describeInContext(ImageEffectDescriptor& des
 
 	srcClip->addSupportedComponent(ePixelComponentRGBA);
 	srcClip->addSupportedComponent(ePixelComponentRGB);
+#ifdef OFX_EXTENSIONS_NATRON
+	srcClip->addSupportedComponent(ePixelComponentXY);
+#endif
 	srcClip->addSupportedComponent(ePixelComponentAlpha);
 	srcClip->setTemporalClipAccess(false);
 	srcClip->setSupportsTiles(kSupportsTiles);
@@ -494,6 +854,9 @@ void LicencePlateBlurPluginFactory::describeInContext(ImageEffectDescriptor& des
 	ClipDescriptor* dstClip = desc.defineClip(kOfxImageEffectOutputClipName);
 	dstClip->addSupportedComponent(ePixelComponentRGBA);
 	dstClip->addSupportedComponent(ePixelComponentRGB);
+#ifdef OFX_EXTENSIONS_NATRON
+	dstClip->addSupportedComponent(ePixelComponentXY);
+#endif
 	dstClip->addSupportedComponent(ePixelComponentAlpha);
 	dstClip->setSupportsTiles(kSupportsTiles);
 
@@ -562,6 +925,80 @@ void LicencePlateBlurPluginFactory::describeInContext(ImageEffectDescriptor& des
 		}
 	}
 
+	{
+		DoubleParamDescriptor* param = desc.defineDoubleParam(kParamSize);
+		param->setLabel(kParamSizeLabel);
+		param->setHint(kParamSizeHint);
+		param->setDefault(kParamSizeDefault);
+		param->setRange(0., DBL_MAX);
+		param->setDisplayRange(0., 100.);
+		param->setIncrement(1.);
+		param->setAnimates(true); // can animate
+		if (page) {
+			page->addChild(*param);
+		}
+	}
+
+	{
+		BooleanParamDescriptor* param = desc.defineBooleanParam(kParamDetect);
+		param->setLabel(kParamDetectLabel);
+		param->setHint(kParamDetectHint);
+		param->setDefault(true);
+		param->setAnimates(false);
+		if (page) {
+			page->addChild(*param);
+		}
+	}
+	{
+		DoubleParamDescriptor* param = desc.defineDoubleParam(kParamEdgeThreshold);
+		param->setLabel(kParamEdgeThresholdLabel);
+		param->setHint(kParamEdgeThresholdHint);
+		param->setDefault(0.15);
+		param->setRange(0., 1.);
+		param->setDisplayRange(0., 1.);
+		param->setAnimates(true); // can animate
+		if (page) {
+			page->addChild(*param);
+		}
+	}
+	{
+		DoubleParamDescriptor* param = desc.defineDoubleParam(kParamEdgeDensity);
+		param->setLabel(kParamEdgeDensityLabel);
+		param->setHint(kParamEdgeDensityHint);
+		param->setDefault(0.2);
+		param->setRange(0., 1.);
+		param->setDisplayRange(0., 1.);
+		param->setAnimates(true); // can animate
+		if (page) {
+			page->addChild(*param);
+		}
+	}
+
+	{
+		BooleanParamDescriptor* param = desc.defineBooleanParam(kParamPlateMask);
+		param->setLabel(kParamPlateMaskLabel);
+		param->setHint(kParamPlateMaskHint);
+		param->setDefault(false);
+		param->setAnimates(false);
+		desc.addClipPreferencesSlaveParam(*param);
+		if (page) {
+			page->addChild(*param);
+		}
+	}
+	{
+		IntParamDescriptor* param = desc.defineIntParam(kParamMaxThreads);
+		param->setLabel(kParamMaxThreadsLabel);
+		param->setHint(kParamMaxThreadsHint);
+		param->setDefault(0);
+		param->setRange(0, INT_MAX);
+		param->setDisplayRange(0, 64);
+		param->setAnimates(false);
+		param->setEvaluateOnChange(false);
+		if (page) {
+			page->addChild(*param);
+		}
+	}
+
 	ofxsPremultDescribeParams(desc, page);
 	ofxsMaskMixDescribeParams(desc, page);
 
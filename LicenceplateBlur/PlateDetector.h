@@ -0,0 +1,257 @@
+#ifndef PLATEDETECTOR_H
+#define PLATEDETECTOR_H
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+#include "Cancellation.h"
+#include "FeaturePlanes.h"
+
+/*
+ * Licence plate candidate detection.
+ *
+ * A plate is a compact, wider-than-tall area with a high density of strong
+ * vertical edges (the characters). The stages only read the FeaturePlanes:
+ * - edge density: count of strong-gradient pixels in each cell of a grid,
+ * - thresholding: cells with enough edge pixels are plate candidates,
+ * - component labelling: connected candidate cells are grouped, and the
+ *   groups with a plate-like shape are kept.
+ */
+
+struct PlateRect
+{
+	int x1, y1, x2, y2; // pixel coordinates, x2 and y2 excluded
+};
+
+struct PlateDetectorParams
+{
+	int cellSize;          // side of a cell, in pixels
+	int edgeThreshold;     // minimum gradient (0-255) of an edge pixel
+	double edgeDensity;    // minimum fraction of edge pixels in a candidate cell
+	double minAspect;      // plate width / height bounds
+	double maxAspect;
+	double maxWidth;       // maximum plate width, as a fraction of the image width
+
+	PlateDetectorParams()
+		: cellSize(8)
+		, edgeThreshold(40)
+		, edgeDensity(0.2)
+		, minAspect(1.5)
+		, maxAspect(8.)
+		, maxWidth(0.5)
+	{
+	}
+};
+
+class PlateDetector
+{
+public:
+	explicit PlateDetector(const PlateDetectorParams& params)
+		: _params(params)
+		, _cellsX(0)
+		, _cellsY(0)
+		, _cancel(NULL)
+	{
+	}
+
+	/** @brief find the plates in the planes, in pixel coordinates (padded by one cell).
+	 *
+	 * Returns false if cancelled, in which case plates is left empty.
+	 */
+	bool detect(const FeaturePlanes& planes, std::vector<PlateRect>* plates, Cancellation* cancel = NULL)
+	{
+		plates->clear();
+		_cancel = cancel;
+		const int cs = (std::max)(1, _params.cellSize);
+		_cellsX = (planes.width + cs - 1) / cs;
+		_cellsY = (planes.height + cs - 1) / cs;
+		if ((_cellsX == 0) || (_cellsY == 0)) {
+			return true;
+		}
+		if (!edgeDensity(planes, cs)) {
+			return false;
+		}
+		threshold(cs);
+		if (!label(planes, cs, plates) || !merge(plates)) {
+			plates->clear();
+
+			return false;
+		}
+
+		return true;
+	}
+
+private:
+	bool aborted() const
+	{
+		return _cancel && _cancel->aborted();
+	}
+
+	/* number of edge pixels in each cell */
+	bool edgeDensity(const FeaturePlanes& planes, int cs)
+	{
+		_density.assign((size_t)_cellsX * _cellsY, 0);
+		const unsigned char t = (unsigned char)(std::min)(255, (std::max)(0, _params.edgeThreshold));
+		for (int y = 0; y < planes.height; ++y) {
+			if (aborted()) {
+				return false;
+			}
+			const unsigned char* g = planes.gradientRow(y);
+			int* cells = &_density[(size_t)(y / cs) * _cellsX];
+			for (int cx = 0; cx < _cellsX; ++cx) {
+				const int xEnd = (std::min)(planes.width, (cx + 1) * cs);
+				int n = 0;
+				for (int x = cx * cs; x < xEnd; ++x) {
+					n += (g[x] >= t);
+				}
+				cells[cx] += n;
+			}
+		}
+
+		return true;
+	}
+
+	void threshold(int cs)
+	{
+		const int minCount = (std::max)(1, (int)(_params.edgeDensity * cs * cs + 0.5));
+		_mask.resize(_density.size());
+		for (size_t i = 0; i < _density.size(); ++i) {
+			_mask[i] = (_density[i] >= minCount);
+		}
+	}
+
+	/* 8-connected components of the candidate cells, filtered by shape */
+	bool label(const FeaturePlanes& planes, int cs, std::vector<PlateRect>* plates)
+	{
+		_labels.assign(_mask.size(), 0);
+		int current = 0;
+		for (int cy = 0; cy < _cellsY; ++cy) {
+			if (aborted()) {
+				return false;
+			}
+			for (int cx = 0; cx < _cellsX; ++cx) {
+				const size_t seed = (size_t)cy * _cellsX + cx;
+				if (!_mask[seed] || _labels[seed]) {
+					continue;
+				}
+				++current;
+				int bx1 = cx, by1 = cy, bx2 = cx, by2 = cy;
+				_stack.clear();
+				_stack.push_back((int)seed);
+				_labels[seed] = current;
+				while (!_stack.empty()) {
+					const int i = _stack.back();
+					_stack.pop_back();
+					const int ix = i % _cellsX;
+					const int iy = i / _cellsX;
+					bx1 = (std::min)(bx1, ix);
+					bx2 = (std::max)(bx2, ix);
+					by1 = (std::min)(by1, iy);
+					by2 = (std::max)(by2, iy);
+					for (int dy = -1; dy <= 1; ++dy) {
+						for (int dx = -1; dx <= 1; ++dx) {
+							const int nx = ix + dx;
+							const int ny = iy + dy;
+							if ((nx < 0) || (nx >= _cellsX) || (ny < 0) || (ny >= _cellsY)) {
+								continue;
+							}
+							const size_t n = (size_t)ny * _cellsX + nx;
+							if (_mask[n] && !_labels[n]) {
+								_labels[n] = current;
+								_stack.push_back((int)n);
+							}
+						}
+					}
+				}
+				const double w = bx2 - bx1 + 1;
+				const double h = by2 - by1 + 1;
+				if ((w < 2) || (w / h < _params.minAspect) || (w / h > _params.maxAspect) ||
+					(w * cs > _params.maxWidth * planes.width)) {
+					continue;
+				}
+				PlateRect r;
+				r.x1 = planes.x1 + (std::max)(0, (bx1 - 1) * cs);
+				r.y1 = planes.y1 + (std::max)(0, (by1 - 1) * cs);
+				r.x2 = planes.x1 + (std::min)(planes.width, (bx2 + 2) * cs);
+				r.y2 = planes.y1 + (std::min)(planes.height, (by2 + 2) * cs);
+				plates->push_back(r);
+			}
+		}
+
+		return true;
+	}
+
+	static bool overlap(const PlateRect& a, const PlateRect& b)
+	{
+		return (a.x1 < b.x2) && (b.x1 < a.x2) && (a.y1 < b.y2) && (b.y1 < a.y2);
+	}
+
+	static bool byX1(const PlateRect& a, const PlateRect& b)
+	{
+		return a.x1 < b.x1;
+	}
+
+	/* the padded rectangles may overlap: merge them, so that no pixel is processed twice.
+	   A sweep goes through the rectangles sorted by x1, and only compares each one with the
+	   merged rectangles that extend past its left edge. A merged rectangle may grow into one
+	   that the sweep has already passed, so sweeps are repeated until nothing merges. */
+	bool merge(std::vector<PlateRect>* plates)
+	{
+		bool merged = true;
+		while (merged) {
+			merged = false;
+			std::sort(plates->begin(), plates->end(), byX1);
+			_merged.clear();
+			_open.clear();
+			for (size_t i = 0; i < plates->size(); ++i) {
+				if (aborted()) {
+					return false;
+				}
+				const PlateRect& r = (*plates)[i];
+				// the rectangles that end before r cannot overlap it, nor any rectangle after it
+				size_t n = 0;
+				for (size_t j = 0; j < _open.size(); ++j) {
+					if (_merged[_open[j]].x2 > r.x1) {
+						_open[n++] = _open[j];
+					}
+				}
+				_open.resize(n);
+				bool absorbed = false;
+				for (size_t j = 0; j < _open.size() && !absorbed; ++j) {
+					PlateRect& a = _merged[_open[j]];
+					if (overlap(a, r)) {
+						a.x1 = (std::min)(a.x1, r.x1);
+						a.y1 = (std::min)(a.y1, r.y1);
+						a.x2 = (std::max)(a.x2, r.x2);
+						a.y2 = (std::max)(a.y2, r.y2);
+						absorbed = true;
+					}
+				}
+				if (absorbed) {
+					merged = true;
+				}
+				else {
+					_open.push_back(_merged.size());
+					_merged.push_back(r);
+				}
+			}
+			plates->swap(_merged);
+		}
+
+		return true;
+	}
+
+	PlateDetectorParams _params;
+	int _cellsX;
+	int _cellsY;
+	std::vector<int> _density;
+	std::vector<unsigned char> _mask;
+	std::vector<int> _labels;
+	std::vector<int> _stack;
+	std::vector<PlateRect> _merged;
+	std::vector<size_t> _open;
+	Cancellation* _cancel;
+};
+
+#endif // !PLATEDETECTOR_H